@@ -80,13 +80,13 @@
 # include <ctype.h>
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <poll.h>
 #if HAVE_PTY_H
 # include <pty.h>
 #endif
-#include <regex.h>
 #include <signal.h>
 #if HAVE_STRING_H
 # if !STDC_HEADERS && HAVE_MEMORY_H
@@ -101,37 +101,100 @@
 # include <stropts.h>
 #endif
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
 #include <termios.h>
+#include <time.h>
 #if HAVE_UTIL_H
 # include <util.h>
 #endif
 
 #define	BUFSZ	(LINE_MAX * 2)
 #define	ESC	0x1b
+#define	KEYLEN	32				/* length of -l key */
+#define	POLLEXP	(POLLERR | POLLHUP | POLLNVAL)
+#define	VT_MAXLEN	32			/* longest sequence we hold */
+#define	RDSZ	(BUFSZ - 1 - VT_MAXLEN)		/* most to filter into tbuf */
+
+/* filter state; a partial escape sequence awaiting the rest */
+struct vtstate {
+    char		pend[VT_MAXLEN];
+    size_t		plen;
+};
+
+/*
+ * an hlogin session; its telnet/ssh child, the pty that it runs on and the
+ * data in transit.  with -l, there is one for each hlogin connection.
+ */
+struct sess {
+    struct sess		*next;
+    struct pollfd	pfds[3];		/* hlogin in, out & ptym */
+    pid_t		child;			/* 0 once reaped */
+    char		name[64],		/* device, for messages */
+			hbuf[BUFSZ],		/* hlogin buffer */
+			rbuf[BUFSZ],		/* telnet/ssh data, unfiltered */
+			tbuf[BUFSZ];		/* telnet/ssh buffer */
+    struct vtstate	vs;			/* tbuf filter state */
+    ssize_t		hlen,			/* len of hbuf */
+			hoff,			/* offset of data in hbuf */
+			tlen,			/* len of tbuf */
+			toff;			/* offset of data in tbuf */
+    int			attached,		/* child has been started */
+			closing,		/* -l: flushing before the end */
+			drained;		/* closing: pty has been drained */
+    time_t		active;			/* time of last i/o */
+    struct timeval	start,			/* session start */
+			held;			/* arrival of oldest tbuf data */
+    unsigned long	calls,			/* poll/read/write syscalls */
+			rbytes,			/* bytes read from telnet/ssh */
+			wbytes,			/* bytes written to hlogin */
+			writes,			/* writes to hlogin */
+			lattot,			/* total write delay (usec) */
+			latmax;			/* longest write delay (usec) */
+};
 
 char		**environ,
-		*progname;
+		key[KEYLEN + 1],		/* -l key */
+		*progname,
+		*replayfile;			/* -r transcript */
 int		debug,
-		sigrx,
+		lsock = -1,			/* -l listen socket */
+		sigchld,			/* SIGCHLD received */
+		sigrx,				/* SIGHUP received */
 		timeo = 5;				/* default timeout   */
-pid_t		child;
+struct sess	*sessions;			/* all sessions */
 
-int		expectmore(char *buf, int len);
-int		filter(char *, int);
-size_t		mystrcspn(const char *, const char *);
+int		bench(const char *);
+int		keygen(const char *);
 RETSIGTYPE	reapchild(int);
+int		replay(const char *);
 #if !HAVE_OPENPTY
 int		openpty(int *, int *, char *, struct termios *,
 			struct winsize *);
 #endif
+int		serve(const char *, const char *);
+int		sess_attach(struct sess *);
+void		sess_close(struct sess *);
+int		sess_drain(struct sess *);
+void		sess_end(struct sess *);
+int		sess_io(struct sess *);
+struct sess	*sess_new(int, int);
+void		sess_reap(void);
+int		sess_spawn(struct sess *, char **);
+void		sess_wrote(struct sess *, ssize_t);
 RETSIGTYPE	sighdlr(int);
 #if !HAVE_UNSETENV
 int		unsetenv(const char *);
 #endif
 void		usage(void);
 void		vers(void);
+size_t		vtbyte(struct vtstate *, char, char *);
+ssize_t		vtcmp(const char *, size_t, int);
+size_t		vtstream(struct vtstate *, const char *, size_t, char *);
+ssize_t		xwrite(int, const char *, size_t);
 
 int
 main(int argc, char **argv, char **ev)
@@ -139,19 +202,13 @@ main(int argc, char **argv, char **ev)
     extern char		*optarg;
     extern int		optind;
     char		ch,
-			hbuf[BUFSZ],		/* hlogin buffer */
-			ptyname[FILENAME_MAX + 1],
-			tbuf[BUFSZ],		/* telnet/ssh buffer */
-			tbufstr[5] = {ESC, '\x07', '\r', '\n', '\0'};
-    int			bytes,			/* bytes read/written */
-			devnull,
-			rval = EX_OK,
-			ptym,			/* master pty */
-			ptys;			/* slave pty */
-    ssize_t		idx,			/* strcspan span */
-			hlen = 0,		/* len of hbuf */
-			tlen = 0;		/* len of tbuf */
-    struct pollfd	pfds[3];
+			*benchfile = NULL,
+			*keyfile = NULL,
+			*port = NULL,
+			*rargv[2];
+    int			n,
+			rval = EX_OK;
+    struct sess		*s;
     struct termios	tios;
 
     environ = ev;
@@ -164,11 +221,23 @@ main(int argc, char **argv, char **ev)
     if (strrchr(progname, '.') != NULL)
 	*(strrchr(progname, '.')) = '\0';
 
-    while ((ch = getopt(argc, argv, "dhvt:")) != -1 )
+    while ((ch = getopt(argc, argv, "b:dhk:l:r:vt:")) != -1 )
 	switch (ch) {
+	case 'b':
+	    benchfile = optarg;
+	    break;
 	case 'd':
 	    debug++;
 	    break;
+	case 'k':
+	    keyfile = optarg;
+	    break;
+	case 'l':
+	    port = optarg;
+	    break;
+	case 'r':
+	    replayfile = optarg;
+	    break;
 	case 't':
 	    timeo = atoi(optarg);
 	    if (timeo < 1)
@@ -183,39 +252,37 @@ main(int argc, char **argv, char **ev)
 	    return(EX_USAGE);
 	}
 
-    if (argc - optind < 2) {
+    if (benchfile != NULL)
+	return(bench(benchfile));
+
+    if (port != NULL) {
+	if (argc - optind != 0) {
+	    usage();
+	    return(EX_USAGE);
+	}
+	unsetenv("DISPLAY");
+	return(serve(port, keyfile));
+    }
+
+    if (replayfile != NULL) {
+	if (argc - optind != 0) {
+	    usage();
+	    return(EX_USAGE);
+	}
+	/* the transcript stands in for telnet/ssh and the device */
+	rargv[0] = replayfile;
+	rargv[1] = NULL;
+	argv = rargv;
+	optind = 0;
+    } else if (argc - optind < 2) {
 	usage();
 	return(EX_USAGE);
     }
 
     unsetenv("DISPLAY");
 
-    for (sigrx = 3; sigrx < 10; sigrx++)
-	close(sigrx);
-
-    /* allocate pty for telnet/ssh, then fork and exec */
-    if (openpty(&ptym, &ptys, ptyname, NULL, NULL)) {
-	fprintf(stderr, "%s: could not allocate pty: %s\n", progname,
-		strerror(errno));
-	return(EX_TEMPFAIL);
-    }
-    /* make the pty raw */
-    if (tcgetattr(ptys, &tios)) {
-	fprintf(stderr, "%s: tcgetattr() failed: %s\n", progname,
-		strerror(errno));
-	return(EX_OSERR);
-    }
-    tios.c_lflag &= ~ECHO;
-    tios.c_lflag &= ~ICANON;
-#ifdef VMIN
-    tios.c_cc[VMIN] = 1;
-    tios.c_cc[VTIME] = 0;
-#endif
-    if (tcsetattr(ptys, TCSANOW, &tios)) {
-	fprintf(stderr, "%s: tcsetattr() failed: %s\n", progname,
-		strerror(errno));
-	return(EX_OSERR);
-    }
+    for (n = 3; n < 10; n++)
+	close(n);
 
     /*
      * if a tty, make it raw as the hp echos _everything_, including
@@ -240,108 +307,40 @@ main(int argc, char **argv, char **ev)
 	}
     }
 
-    /* zero the buffers */
-    memset(hbuf, 0, BUFSZ);
-    memset(tbuf, 0, BUFSZ);
-
-    /* reap our children, must be set-up *after* openpty() */
-    signal(SIGCHLD, reapchild);
-
-    if ((child = fork()) == -1) {
-	fprintf(stderr, "%s: fork() failed: %s\n", progname, strerror(errno));
+    if ((s = sess_new(fileno(stdin), fileno(stdout))) == NULL) {
+	fprintf(stderr, "%s: malloc() failed: %s\n", progname,
+		strerror(errno));
 	return(EX_TEMPFAIL);
     }
 
-    if (child == 0) {
-	struct winsize ws;
-
-	/*
-	 * Make sure our terminal length and width are something greater
-	 * than 1, for pagers on stupid boxes.
-	 */
-	ioctl(ptys, TIOCGWINSZ, &ws);
-	ws.ws_row = 24;
-	ws.ws_col = 132;
-	ioctl(ptys, TIOCSWINSZ, &ws);
-
-	signal(SIGCHLD, SIG_DFL);
-	/* close the master pty & std* inherited from the parent */
-	close(ptym);
-	if (ptys != 0)
-	    close(0);
-	if (ptys != 1)
-	    close(1);
-	if (ptys != 2)
-	    close(2);
-#ifdef TIOCSCTTY
-	setsid();
-	if (ioctl(ptys, TIOCSCTTY, NULL) == -1) {
-	    snprintf(ptyname, FILENAME_MAX, "%s: could not set controlling "
-		     "tty: %s\n", progname, strerror(errno));
-	    write(0, ptyname, strlen(ptyname));
-	    return(EX_OSERR);
-	}
-#endif
-
-	/* close stdin/out/err and attach them to the pipes */
-	if (dup2(ptys, 0) == -1 || dup2(ptys, 1) == -1 || dup2(ptys, 2) == -1) {
-	    snprintf(ptyname, FILENAME_MAX, "%s: dup2() failed: %s\n", progname,
-		     strerror(errno));
-	    write(0, ptyname, strlen(ptyname));
-	    return(EX_OSERR);
-	}
-	if (ptys > 2)
-	    close(ptys);
-
-	/* exec telnet/ssh */
-	execvp(argv[optind], argv + optind);
-	snprintf(ptyname, FILENAME_MAX, "%s: execvp() failed: %s\n", progname,
-		 strerror(errno));
-	write(0, ptyname, strlen(ptyname));
-	return(EX_TEMPFAIL);
-	/*NOTREACHED*/
-    }
+    /* reap our children */
+    signal(SIGCHLD, reapchild);
 
-    /* parent */
-    if (debug)
-	fprintf(stderr, "child %d\n", (int)child);
+    if ((rval = sess_spawn(s, argv + optind)) != EX_OK)
+	return(rval);
 
     signal(SIGHUP, sighdlr);
 
-    /* close the slave pty */
-    close(ptys);
-
-    devnull = open("/dev/null", O_RDWR);
-
     /* make FDs non-blocking */
-    if (fcntl(ptym, F_SETFL, O_NONBLOCK) ||
-	fcntl(fileno(stdin), F_SETFL, O_NONBLOCK) ||
+    if (fcntl(fileno(stdin), F_SETFL, O_NONBLOCK) ||
 	fcntl(fileno(stdout), F_SETFL, O_NONBLOCK)) {
 	fprintf(stderr, "%s: fcntl(NONBLOCK) failed: %s\n", progname,
 		strerror(errno));
 	exit(EX_OSERR);
     }
 
-    /* loop to read on stdin and ptym */
-#define	POLLEXP	(POLLERR | POLLHUP | POLLNVAL)
-    pfds[0].fd = fileno(stdin);
-    pfds[0].events = POLLIN | POLLEXP;
-    pfds[1].fd = fileno(stdout);
-    pfds[1].events = POLLEXP;
-    pfds[2].fd = ptym;
-    pfds[2].events = POLLIN | POLLEXP;
-
     /* shuffle data across the pipes until we see EOF or a read/write error */
-    sigrx = 0;
     while (1) {
-	bytes = poll(pfds, 3, (timeo * 1000));
-	if (bytes == 0) {
-	    if (sigrx)
+	if (sigchld)
+	    sess_reap();
+	n = poll(s->pfds, 3, (timeo * 1000));
+	if (n == 0) {
+	    if (sigrx || s->child == 0)
 		break;
 	    /* timeout */
 	    continue;
 	}
-	if (bytes == -1) {
+	if (n == -1) {
 	    switch (errno) {
 	    case EAGAIN:
 	    case EINTR:
@@ -353,316 +352,912 @@ main(int argc, char **argv, char **ev)
 	    continue;
 	}
 
-	/*
-	 * write buffers first
-	 * write hbuf (aka hlogin/stdin/pfds[0]) -> telnet (aka ptym/pfds[2])
-	 */
-	if ((pfds[2].revents & POLLOUT) && hlen) {
-	    if ((bytes = write(pfds[2].fd, hbuf, hlen)) < 0 &&
-		errno != EINTR && errno != EAGAIN) {
-		fprintf(stderr, "%s: write() failed: %s\n", progname,
-			strerror(errno));
-		hlen = 0;
-		hbuf[0] = '\0';
-		break;
-	    } else if (bytes > 0) {
-		hlen -= bytes;
-		memmove(hbuf, hbuf + bytes, hlen + 1);
-		if (hlen < 1)
-		     pfds[2].events &= ~POLLOUT;
-	    }
-	}
-	if (pfds[2].revents & POLLEXP) {
-	    hlen = 0;
-	    hbuf[0] = '\0';
+	if (sess_io(s))
 	    break;
+    }
+    sess_end(s);
+
+    return(rval);
+}
+
+/*
+ * vt100/220 escape codes that are removed or replaced with CR NL, in the
+ * order of precedence used when more than one could match.
+ */
+enum {
+    VT_DS,					/* ds */
+    VT_FS,					/* fs */
+    VT_ED,
+    VT_KE,					/* kE */
+    VT_CS,					/* cs */
+    VT_CM,					/* cm */
+    VT_SM6,
+    VT_RA,					/* RA */
+    VT_VE,					/* ve */
+    VT_VI,					/* vi */
+    VT_CE,					/* ce */
+    VT_MR,					/* mr - ansi */
+    VT_BEL,					/* bell */
+    /* replace these with CR NL */
+    VT_ME,					/* me */
+    VT_NEL,
+    VT_N					/* number of sequences */
+};
+#define	VT_CR		VT_ME			/* first CR replacement */
+
+/* the sequences themselves, NULL for ESC [ [0-9]+ ; [0-9]+ (r|H) */
+static const char	*vtseq[VT_N] = {
+				"\x1B""7\x1B[1;24r\x1B""8",
+				"\x1B""8",
+				"\x1B[2J",
+				"\x1B[2K",
+				NULL,
+				NULL,
+				"\x1B[?6l",
+				"\x1B[?7l",
+				"\x1B[?25h",
+				"\x1B[?25l",
+				"\x1B[K",
+				"\x1B[7m",
+				"\x07",
+				"\x1B[0m",
+				"\x1B""E",
+			};
+
+/*
+ * -b: replay the file through the filter one byte per read, so that every
+ * byte boundary is also a read boundary, and check that the result is the
+ * same as filtering it in one go.  report the filter's throughput both ways
+ * and how much input was held back at the boundaries awaiting the rest of an
+ * escape sequence; ie: the data that hlogin would be waiting for.
+ */
+int
+bench(const char *file)
+{
+    struct stat		sb;
+    struct timeval	t0,
+			t1,
+			t2;
+    struct vtstate	vs;
+    char		*in,
+			*out1,
+			*out2;
+    size_t		held = 0,
+			heldmax = 0,
+			heldn = 0,
+			len,
+			n1,
+			n2,
+			r;
+    int			fd;
+    double		s1,
+			s2;
+
+    if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &sb)) {
+	fprintf(stderr, "%s: could not open %s: %s\n", progname, file,
+		strerror(errno));
+	return(EX_NOINPUT);
+    }
+    len = sb.st_size;
+    if ((in = malloc(len + 1)) == NULL || (out1 = malloc(len + 1)) == NULL ||
+	(out2 = malloc(len + 1)) == NULL) {
+	fprintf(stderr, "%s: malloc() failed: %s\n", progname,
+		strerror(errno));
+	return(EX_TEMPFAIL);
+    }
+    if (read(fd, in, len) != (ssize_t)len) {
+	fprintf(stderr, "%s: could not read %s: %s\n", progname, file,
+		strerror(errno));
+	return(EX_IOERR);
+    }
+    close(fd);
+
+    /* in one go */
+    gettimeofday(&t0, NULL);
+    memset(&vs, 0, sizeof(vs));
+    n1 = vtstream(&vs, in, len, out1);
+    memcpy(out1 + n1, vs.pend, vs.plen);
+    n1 += vs.plen;
+
+    /* a byte at a time */
+    gettimeofday(&t1, NULL);
+    memset(&vs, 0, sizeof(vs));
+    for (n2 = r = 0; r < len; r++) {
+	n2 += vtstream(&vs, in + r, 1, out2 + n2);
+	if (vs.plen) {
+	    heldn++;
+	    held += vs.plen;
+	    if (vs.plen > heldmax)
+		heldmax = vs.plen;
 	}
+    }
+    memcpy(out2 + n2, vs.pend, vs.plen);
+    n2 += vs.plen;
+    gettimeofday(&t2, NULL);
+
+    s1 = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+    s2 = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+    printf("%s: %lu bytes in, %lu out\n", file, (unsigned long)len,
+	   (unsigned long)n1);
+    printf("one read:      %.1f MB/s\n", s1 > 0 ? len / s1 / 1e6 : 0);
+    printf("byte per read: %.1f MB/s\n", s2 > 0 ? len / s2 / 1e6 : 0);
+    printf("boundaries holding data: %lu of %lu, avg %.1f max %lu bytes\n",
+	   (unsigned long)heldn, (unsigned long)len,
+	   heldn ? (double)held / heldn : 0, (unsigned long)heldmax);
+    if (n1 != n2 || memcmp(out1, out2, n1) != 0) {
+	printf("output differs when split\n");
+	return(EX_SOFTWARE);
+    }
 
-	/* write tbuf (aka telnet/ptym/pfds[2]) -> hlogin (stdout/pfds[1]) */
-	if ((pfds[1].revents & POLLOUT) && tlen) {
-	    /*
-	     * if there is an escape char that didnt get filter()'d,
-	     * we need to write only up to that point and wait for
-	     * the bits that complete the escape sequence.  if at least
-	     * two bytes follow it and it doesn't look like we should expect
-	     * more data, write it anyway as filter() didnt match it.
-	     */
-	    bytes = tlen;
-	    idx = mystrcspn(tbuf, tbufstr);
-	    if (idx) {
-		if (tbuf[idx] == ESC) {
-		    if (tlen - idx < 2 || expectmore(&tbuf[idx], tlen - idx)) {
-			bytes = idx;
-		    }
-		}
-		if (tbuf[idx] == '\r' || tbuf[idx] == '\n') {
-		    bytes = ++idx;
-		    if (tbuf[idx] == '\r' || tbuf[idx] == '\n')
-			bytes++;
-		}
-	    } else {
-		if (tbuf[0] == ESC) {
-		    if (tlen < 2 || expectmore(tbuf, tlen)) {
-			bytes = 0;
-		    }
-		}
-		if (tbuf[0] == '\r' || tbuf[0] == '\n') {
-		    bytes = 1;
-		    if (tbuf[1] == '\r' || tbuf[1] == '\n')
-			bytes++;
-		}
+    return(EX_OK);
+}
+
+/*
+ * -l: generate the key that hlogin must present when connecting and save it
+ * in keyfile, readable only by us.
+ */
+int
+keygen(const char *keyfile)
+{
+    unsigned char	rnd[KEYLEN / 2];
+    size_t		i;
+    int			fd;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1 ||
+	read(fd, rnd, sizeof(rnd)) != sizeof(rnd)) {
+	fprintf(stderr, "%s: could not read /dev/urandom: %s\n", progname,
+		strerror(errno));
+	return(-1);
+    }
+    close(fd);
+    for (i = 0; i < sizeof(rnd); i++)
+	snprintf(key + i * 2, 3, "%02x", rnd[i]);
+
+    unlink(keyfile);
+    if ((fd = open(keyfile, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1 ||
+	write(fd, key, KEYLEN) != KEYLEN || write(fd, "\n", 1) != 1 ||
+	close(fd)) {
+	fprintf(stderr, "%s: could not write %s: %s\n", progname, keyfile,
+		strerror(errno));
+	return(-1);
+    }
+
+    return(0);
+}
+
+RETSIGTYPE
+reapchild(int sig)
+{
+    if (debug)
+	fprintf(stderr, "GOT SIGNAL %d\n", sig);
+
+    /* sess_reap() does the work, outside of the signal handler */
+    sigchld = 1;
+    return;
+}
+
+/*
+ * -r: run in the child in place of telnet/ssh, writing the transcript to the
+ * pty as a device would.  the chunk size varies so that escape sequences
+ * are split across writes, in a repeatable manner.  output processing is
+ * disabled, as the transcript is what the device sent through telnet/ssh.
+ */
+int
+replay(const char *file)
+{
+    char		buf[BUFSZ];
+    ssize_t		bytes,
+			len,
+			off;
+    unsigned int	seed = 1;
+    int			fd;
+    struct termios	tios;
+
+    if ((fd = open(file, O_RDONLY)) == -1) {
+	fprintf(stderr, "%s: could not open %s: %s\n", progname, file,
+		strerror(errno));
+	return(EX_NOINPUT);
+    }
+    if (tcgetattr(1, &tios) == 0) {
+	tios.c_oflag &= ~OPOST;
+	tcsetattr(1, TCSANOW, &tios);
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+	for (off = 0; off < len; off += bytes) {
+	    seed = seed * 1103515245 + 12345;
+	    bytes = 1 + (seed >> 16) % (len - off < 512 ? len - off : 512);
+	    if ((bytes = write(1, buf + off, bytes)) < 0) {
+		if (errno == EINTR)
+		    bytes = 0;
+		else
+		    return(EX_IOERR);
 	    }
+	}
+    }
+    if (len < 0)
+	return(EX_IOERR);
+    tcdrain(1);
+    close(fd);
+
+    return(EX_OK);
+}
+
+/*
+ * -l: listen on the loopback port for hlogin connections and relay each one
+ * through its own telnet/ssh child and pty, all from this one process.
+ */
+int
+serve(const char *port, const char *keyfile)
+{
+    struct pollfd	*pfds = NULL;
+    struct sess		*next,
+			*s;
+    struct sockaddr_in	sin;
+    char		*home,
+			path[FILENAME_MAX + 1];
+    int			fd,
+			i,
+			n,
+			npfds = 0,
+			on = 1;
+    time_t		now;
+
+    if (keyfile == NULL) {
+	if ((home = getenv("HOME")) == NULL) {
+	    fprintf(stderr, "%s: HOME is not set, use -k\n", progname);
+	    return(EX_USAGE);
+	}
+	snprintf(path, sizeof(path), "%s/.hpuifilter", home);
+	keyfile = path;
+    }
 
-	    if ((bytes = write(pfds[1].fd, tbuf, bytes)) < 0 &&
-		errno != EINTR && errno != EAGAIN) {
-		fprintf(stderr, "%s: write() failed: %s\n", progname,
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(atoi(port));
+    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+	bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) ||
+	listen(lsock, 64) ||
+	fcntl(lsock, F_SETFL, O_NONBLOCK) ||
+	fcntl(lsock, F_SETFD, FD_CLOEXEC)) {
+	fprintf(stderr, "%s: could not listen on port %s: %s\n", progname,
+		port, strerror(errno));
+	return(EX_OSERR);
+    }
+    if (keygen(keyfile))
+	return(EX_CANTCREAT);
+
+    signal(SIGCHLD, reapchild);
+    signal(SIGHUP, sighdlr);
+    signal(SIGINT, sighdlr);
+    signal(SIGTERM, sighdlr);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (! sigrx) {
+	if (sigchld)
+	    sess_reap();
+
+	/* the listen socket, then three for each session */
+	for (n = 1, s = sessions; s != NULL; s = s->next)
+	    n += 3;
+	if (n > npfds) {
+	    if ((pfds = realloc(pfds, n * sizeof(*pfds))) == NULL) {
+		fprintf(stderr, "%s: malloc() failed: %s\n", progname,
 			strerror(errno));
-		/* dont bother trying to flush tbuf */
-		tlen = 0;
-		tbuf[0] = '\0';
 		break;
-	    } else if (bytes > 0) {
-		tlen -= bytes;
-		memmove(tbuf, tbuf + bytes, tlen + 1);
-		if (tlen < 1)
-		    pfds[1].events &= ~POLLOUT;
 	    }
+	    npfds = n;
 	}
-	if (pfds[1].revents & POLLEXP) {
-	    /* dont bother trying to flush tbuf */
-	    tlen = 0;
-	    tbuf[0] = '\0';
+	pfds[0].fd = lsock;
+	pfds[0].events = POLLIN;
+	for (i = 1, s = sessions; s != NULL; s = s->next, i += 3)
+	    memcpy(&pfds[i], s->pfds, sizeof(s->pfds));
+
+	if ((n = poll(pfds, i, (timeo * 1000))) == -1) {
+	    if (errno == EAGAIN || errno == EINTR)
+		continue;
+	    fprintf(stderr, "%s: poll() failed: %s\n", progname,
+		    strerror(errno));
 	    break;
 	}
 
-	/* read hlogin (aka stdin/pfds[0]) -> hbuf */
-	if (pfds[0].revents & POLLIN) {
-	    if (BUFSZ - hlen > 1) {
-		bytes = read(pfds[0].fd, hbuf + hlen, (BUFSZ - 1) - hlen);
-		if (bytes > 0) {
-		    hlen += bytes;
-		    hbuf[hlen] = '\0';
-		    pfds[2].events |= POLLOUT;
-		} else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
-		    /* read error */
-		    break;
-		}
-	    }
+	/*
+	 * end sessions on error/EOF, those whose child has exited and gone
+	 * quiet, and connections that do not send their header line in time.
+	 * a closing session ends once hlogin has taken the rest of its data,
+	 * or has not taken any of it in timeo.
+	 */
+	now = time(NULL);
+	for (i = 1, s = sessions; s != NULL; s = next, i += 3) {
+	    next = s->next;
+	    memcpy(s->pfds, &pfds[i], sizeof(s->pfds));
+	    if (s->closing) {
+		if (s->pfds[1].revents ? sess_drain(s) :
+					 now - s->active >= timeo)
+		    sess_end(s);
+	    } else if (s->pfds[0].revents | s->pfds[1].revents |
+		       s->pfds[2].revents) {
+		if (sess_io(s))
+		    sess_close(s);
+	    } else if ((s->child == 0 || ! s->attached) &&
+		       now - s->active >= timeo)
+		sess_close(s);
 	}
-	if (pfds[0].revents & POLLEXP)
-	    break;
 
-	/* read telnet/ssh (aka ptym/pfds[2]) -> tbuf, then filter */
-	if (pfds[2].revents & POLLIN) {
-	    if (BUFSZ - tlen > 1) {
-		bytes = read(pfds[2].fd, tbuf + tlen, (BUFSZ - 1) - tlen);
-		if (bytes > 0) {
-		    tlen += bytes;
-		    tbuf[tlen] = '\0';
-		    tlen = filter(tbuf, tlen);
-		    if (tlen > 0)
-			pfds[1].events |= POLLOUT;
-		} else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
-		    /* read error */
-		    break;
+	if (pfds[0].revents & POLLIN) {
+	    while ((fd = accept(lsock, NULL, NULL)) != -1) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+		    (s = sess_new(fd, fd)) == NULL) {
+		    fprintf(stderr, "%s: could not accept connection: %s\n",
+			    progname, strerror(errno));
+		    close(fd);
+		    continue;
 		}
+		s->attached = 0;
 	    }
 	}
-	if (pfds[2].revents & POLLEXP)
-	    break;
     }
-    /* try to flush any remaining data from our buffers */
-    if (hlen) {
-	(void)write(pfds[2].fd, hbuf, hlen);
-	hlen = 0;
-    }
-    if (tlen) {
-	(void)write(pfds[1].fd, tbuf, tlen);
-	tlen = 0;
+
+    while (sessions != NULL)
+	sess_end(sessions);
+    close(lsock);
+    unlink(keyfile);
+    free(pfds);
+
+    return(EX_OK);
+}
+
+/*
+ * -l: read the header line that hlogin sends on connecting; the key and the
+ * telnet/ssh command-line, separated by tabs.  then start the child.  return
+ * non-zero if the session should be ended.
+ */
+int
+sess_attach(struct sess *s)
+{
+    char	*argv[64],
+		*cp,
+		*nl;
+    int		argc;
+
+    if ((nl = memchr(s->hbuf + s->hoff, '\n', s->hlen)) == NULL)
+	/* wait for the rest, unless it will never fit */
+	return(s->hoff + s->hlen >= BUFSZ - 1);
+    *nl = '\0';
+    cp = s->hbuf + s->hoff;
+    s->hlen -= nl + 1 - cp;
+    s->hoff += nl + 1 - cp;
+
+    for (argc = 0; argc < 63 && cp != NULL; argc++) {
+	argv[argc] = cp;
+	if ((cp = strchr(cp, '\t')) != NULL)
+	    *cp++ = '\0';
     }
-    if ((bytes = read(pfds[2].fd, tbuf, (BUFSZ - 1))) > 0) {
-	tbuf[bytes] = '\0';
-	tlen = filter(tbuf, bytes);
-	(void)write(pfds[1].fd, tbuf, tlen);
+    argv[argc] = NULL;
+    if (strcmp(argv[0], key) != 0) {
+	fprintf(stderr, "%s: connection with invalid key\n", progname);
+	return(1);
     }
-    tcdrain(pfds[1].fd);
-    if ((hlen = read(pfds[0].fd, hbuf, (BUFSZ - 1))) > 0) {
-	(void)write(pfds[2].fd, hbuf, hlen);
+    if (argc < 3) {
+	fprintf(stderr, "%s: connection without a command\n", progname);
+	return(1);
     }
-    tcdrain(pfds[2].fd);
+    if (sess_spawn(s, argv + 1) != EX_OK)
+	return(1);
+    s->attached = 1;
+    if (s->hlen > 0)
+	s->pfds[2].events |= POLLOUT;
+
+    return(0);
+}
 
-    if (child && ! kill(child, SIGINT))
-	reapchild(SIGCHLD);
+/*
+ * -l: begin to end a session.  what remains for hlogin is written as the
+ * poll loop finds it ready, by sess_drain(), so that a slow hlogin does not
+ * hold up the other sessions as sess_end()'s blocking flush would.
+ */
+void
+sess_close(struct sess *s)
+{
+    if (s->pfds[2].fd != -1 && s->hlen) {
+	(void)write(s->pfds[2].fd, s->hbuf + s->hoff, s->hlen);
+	s->hlen = 0;
+    }
+    s->closing = 1;
+    s->pfds[0].events = 0;
+    s->pfds[2].events = 0;
+    if (sess_drain(s))
+	sess_end(s);
 
-    return(rval);
+    return;
 }
 
 /*
- * return non-zero if the escape sequence beginning with buf appears to be
- * incomplete (and the caller should wait for more data).
+ * write what of a closing session's data hlogin will take without blocking,
+ * refilling tbuf from the pty until it is drained.  return non-zero once
+ * all has been written or on a write error.
  */
 int
-expectmore(char *buf, int len)
+sess_drain(struct sess *s)
 {
-    int	i;
-
-    if (buf[1] == '[' || isdigit((int)buf[1])) {
-	/* look for a char that ends the sequence */
-	for (i = 2; i < len; i++) {
-	    if (isalpha((int)buf[i]))
+    struct pollfd	*pfds = s->pfds;
+    ssize_t		bytes;
+
+    for (;;) {
+	if (s->tlen) {
+	    if ((bytes = write(pfds[1].fd, s->tbuf + s->toff, s->tlen)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+		    return(1);
+		pfds[1].events = POLLOUT | POLLEXP;
 		return(0);
+	    }
+	    s->active = time(NULL);
+	    s->calls++;
+	    sess_wrote(s, bytes);
+	    s->tlen -= bytes;
+	    s->toff += bytes;
+	    continue;
+	}
+	s->toff = 0;
+	if (s->drained)
+	    return(1);
+	if (pfds[2].fd != -1 && ++s->calls &&
+	    (bytes = read(pfds[2].fd, s->rbuf, RDSZ)) > 0) {
+	    gettimeofday(&s->held, NULL);
+	    s->rbytes += bytes;
+	    s->tlen = vtstream(&s->vs, s->rbuf, bytes, s->tbuf);
+	} else {
+	    /* a sequence that never completed is not one of ours */
+	    memcpy(s->tbuf, s->vs.pend, s->vs.plen);
+	    s->tlen = s->vs.plen;
+	    s->vs.plen = 0;
+	    s->drained = 1;
 	}
-	return(1);
     }
-    if (buf[1] == '#') {
-	/* look for terminating digit */
-	for (i = 2; i < len; i++) {
-	    if (isdigit((int)buf[i]))
-		return(0);
+}
+
+/*
+ * flush what remains in the session's buffers, drain the pty and interrupt
+ * the child.  a session closed by sess_close() has already been flushed as
+ * far as hlogin would allow.
+ */
+void
+sess_end(struct sess *s)
+{
+    struct sess		**sp;
+    struct timeval	now;
+    double		secs;
+    ssize_t		bytes;
+    int			in = s->pfds[0].fd,
+			out = s->pfds[1].fd,
+			ptym = s->pfds[2].fd;
+
+    /*
+     * try to flush any remaining data from our buffers.  the pty may still
+     * hold more than one read's worth after the child hangs-up, so drain it
+     * until EOF.
+     */
+    if (ptym != -1 && s->hlen) {
+	(void)write(ptym, s->hbuf + s->hoff, s->hlen);
+	s->hlen = 0;
+    }
+    if (! s->closing) {
+	if (s->tlen) {
+	    s->calls++;
+	    if (xwrite(out, s->tbuf + s->toff, s->tlen) > 0)
+		sess_wrote(s, s->tlen);
+	    s->tlen = 0;
 	}
-	return(1);
+	while (ptym != -1 && ++s->calls &&
+	       (bytes = read(ptym, s->rbuf, RDSZ)) > 0) {
+	    gettimeofday(&s->held, NULL);
+	    s->rbytes += bytes;
+	    s->tlen = vtstream(&s->vs, s->rbuf, bytes, s->tbuf);
+	    if (s->tlen == 0)
+		continue;
+	    s->calls++;
+	    if (xwrite(out, s->tbuf, s->tlen) < 0)
+		break;
+	    sess_wrote(s, s->tlen);
+	}
+	/* a sequence that never completed is not one of ours */
+	if (s->vs.plen) {
+	    s->calls++;
+	    if (xwrite(out, s->vs.pend, s->vs.plen) > 0)
+		sess_wrote(s, s->vs.plen);
+	}
+	tcdrain(out);
+    }
+    s->tlen = 0;
+    if (ptym != -1) {
+	if ((bytes = read(in, s->hbuf, (BUFSZ - 1))) > 0) {
+	    (void)write(ptym, s->hbuf, bytes);
+	}
+	tcdrain(ptym);
     }
 
-    return(0);
+    if (s->child && ! kill(s->child, SIGINT))
+	sess_reap();
+
+    if ((lsock != -1 && s->attached) || replayfile != NULL || debug) {
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - s->start.tv_sec) +
+	       (now.tv_usec - s->start.tv_usec) / 1000000.0;
+	fprintf(stderr, "%s: %s: %lu bytes in, %lu out in %.1fs (%.0f "
+		"bytes/s), %lu writes, %.1f syscalls/KB, delay avg %luus max "
+		"%luus\n", progname, s->name, s->rbytes, s->wbytes, secs,
+		secs > 0 ? s->wbytes / secs : 0, s->writes,
+		s->rbytes ? s->calls * 1024.0 / s->rbytes : 0,
+		s->writes ? s->lattot / s->writes : 0, s->latmax);
+    }
+
+    if (lsock != -1) {
+	close(in);
+	if (ptym != -1)
+	    close(ptym);
+    }
+    for (sp = &sessions; *sp != NULL; sp = &(*sp)->next) {
+	if (*sp == s) {
+	    *sp = s->next;
+	    break;
+	}
+    }
+    free(s);
+
+    return;
 }
 
 /*
- * Remove/replace vt100/220 screen manipulation escape sequences so they do
- * not litter the output.
+ * handle the poll() results for a session; shuffle data between the hlogin
+ * and telnet/ssh buffers.  return non-zero on EOF or a read/write error.
  */
 int
-filter(char *buf, int len)
+sess_io(struct sess *s)
 {
-    static regmatch_t	pmatch[1];
-#define	N_REG		15		/* number of regexes in reg[][] */
-#define	N_CRs		2		/* number of CR replacements */
-    static regex_t	preg[N_REG];
-    static char		reg[N_REG][50] = {	/* vt100/220 escape codes */
-				"\x1B""7\x1B\\[1;24r\x1B""8",	/* ds */
-				"\x1B""8",			/* fs */
-
-				"\x1B\\[2J",
-				"\x1B\\[2K",			/* kE */
-
-				"\x1B\\[[0-9]+;[0-9]+r",	/* cs */
-				"\x1B\\[[0-9]+;[0-9]+H",	/* cm */
-
-				"\x1B\\[\\?6l",
-				"\x1B\\[\\?7l",			/* RA */
-				"\x1B\\[\\?25h",		/* ve */
-				"\x1B\\[\\?25l",		/* vi */
-				"\x1B\\[K",			/* ce */
-				"\x1B\\[7m",			/* mr - ansi */
-				"\x07",				/* bell */
-
-				/* replace these with CR */
-				"\x1B\\[0m",			/* me */
-				"\x1B""E",
-			};
-    char		bufstr[3] = {ESC, '\x07', '\0'},
-			ebuf[256];
-    size_t		nmatch = 1;
-    int			err,
-			x;
-    static int		init = 0;
-
-    if (len == 0 || mystrcspn(buf, bufstr) >= len)
-	return(len);
-
-    if (! init) {
-	init++;
-	for (x = 0; x < N_REG; x++) {
-	    memset(&preg[x], 0, sizeof(preg[x]));
-	    if ((err = regcomp(&preg[x], reg[x], REG_EXTENDED))) {
-		regerror(err, &preg[x], ebuf, 256);
-		fprintf(stderr, "%s: regex compile failed: %s\n", progname,
-			ebuf);
-		abort();
+    struct pollfd	*pfds = s->pfds;
+    char		*cp;
+    ssize_t		bytes;			/* bytes read/written */
+
+    s->active = time(NULL);
+    s->calls++;					/* the poll() that woke us */
+
+    /*
+     * write buffers first
+     * write hbuf (aka hlogin/stdin/pfds[0]) -> telnet (aka ptym/pfds[2])
+     */
+    if ((pfds[2].revents & POLLOUT) && s->hlen) {
+	s->calls++;
+	if ((bytes = write(pfds[2].fd, s->hbuf + s->hoff, s->hlen)) < 0 &&
+	    errno != EINTR && errno != EAGAIN) {
+	    fprintf(stderr, "%s: write() failed: %s\n", progname,
+		    strerror(errno));
+	    s->hlen = s->hoff = 0;
+	    s->hbuf[0] = '\0';
+	    return(1);
+	} else if (bytes > 0) {
+	    s->hlen -= bytes;
+	    s->hoff += bytes;
+	    if (s->hlen < 1) {
+		 s->hoff = 0;
+		 s->hbuf[0] = '\0';
+		 pfds[2].events &= ~POLLOUT;
 	    }
 	}
     }
+    if (pfds[2].revents & POLLEXP) {
+	s->hlen = s->hoff = 0;
+	s->hbuf[0] = '\0';
+	return(1);
+    }
 
-    for (x = 0; x < N_REG - N_CRs; x++) {
-	if ((err = regexec(&preg[x], buf, nmatch, pmatch, 0))) {
-	    if (err != REG_NOMATCH) {
-		regerror(err, &preg[x], ebuf, 256);
-		fprintf(stderr, "%s: regexec failed: %s\n", progname, ebuf);
-		abort();
+    /* write tbuf (aka telnet/ptym/pfds[2]) -> hlogin (stdout/pfds[1]) */
+    if ((pfds[1].revents & POLLOUT) && s->tlen) {
+	/*
+	 * write everything we have, all complete lines and any partial
+	 * one, in one go.  tbuf holds only filtered data; a partial escape
+	 * sequence is held in the filter's state until the rest arrives.
+	 */
+	s->calls++;
+	if ((bytes = write(pfds[1].fd, s->tbuf + s->toff, s->tlen)) < 0 &&
+	    errno != EINTR && errno != EAGAIN) {
+	    fprintf(stderr, "%s: write() failed: %s\n", progname,
+		    strerror(errno));
+	    /* dont bother trying to flush tbuf */
+	    s->tlen = s->toff = 0;
+	    s->tbuf[0] = '\0';
+	    return(1);
+	} else if (bytes > 0) {
+	    sess_wrote(s, bytes);
+	    /* there is room in tbuf again */
+	    pfds[2].events |= POLLIN;
+	    s->tlen -= bytes;
+	    s->toff += bytes;
+	    if (s->tlen < 1) {
+		s->toff = 0;
+		s->tbuf[0] = '\0';
+		pfds[1].events &= ~POLLOUT;
 	    }
-	} else {
-	    if (len - pmatch[0].rm_eo <= 0) {
-		buf[pmatch[0].rm_so] = '\0';
-	    } else {
-		memmove(buf + pmatch[0].rm_so, buf + pmatch[0].rm_eo,
-		       len - pmatch[0].rm_eo + 1);
+	}
+    }
+    if (pfds[1].revents & POLLEXP) {
+	/* dont bother trying to flush tbuf */
+	s->tlen = s->toff = 0;
+	s->tbuf[0] = '\0';
+	return(1);
+    }
+
+    /* read hlogin (aka stdin/pfds[0]) -> hbuf */
+    if (pfds[0].revents & POLLIN) {
+	/* shift unwritten data down only when short of room */
+	if (s->hoff && BUFSZ - (s->hoff + s->hlen) < LINE_MAX) {
+	    memmove(s->hbuf, s->hbuf + s->hoff, s->hlen + 1);
+	    s->hoff = 0;
+	}
+	if (BUFSZ - (s->hoff + s->hlen) > 1) {
+	    s->calls++;
+	    bytes = read(pfds[0].fd, s->hbuf + s->hoff + s->hlen,
+			 (BUFSZ - 1) - (s->hoff + s->hlen));
+	    if (bytes > 0) {
+		s->hlen += bytes;
+		s->hbuf[s->hoff + s->hlen] = '\0';
+		if (! s->attached)
+		    return(sess_attach(s));
+		pfds[2].events |= POLLOUT;
+	    } else if (bytes == 0 && ! s->attached) {
+		return(1);
+	    } else if (bytes == 0) {
+		/* EOF; nothing more from hlogin, do not poll for it */
+		pfds[0].events &= ~POLLIN;
+	    } else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+		/* read error */
+		return(1);
 	    }
-	    len -= pmatch[0].rm_eo - pmatch[0].rm_so;
-	    /* start over with the first regex */
-	    x = -1;
 	}
     }
+    if (pfds[0].revents & POLLEXP)
+	return(1);
 
-    /* now the CR NL replacements */
-    for (x = N_REG - N_CRs; x < N_REG; x++) {
-	if ((err = regexec(&preg[x], buf, nmatch, pmatch, 0))) {
-	    if (err != REG_NOMATCH) {
-		regerror(err, &preg[x], ebuf, 256);
-		fprintf(stderr, "%s: regexec failed: %s\n", progname, ebuf);
-		abort();
+    /* read telnet/ssh (aka ptym/pfds[2]) -> tbuf, then filter */
+    if (pfds[2].revents & POLLIN) {
+	if (s->toff && BUFSZ - (s->toff + s->tlen) < LINE_MAX) {
+	    memmove(s->tbuf, s->tbuf + s->toff, s->tlen + 1);
+	    s->toff = 0;
+	}
+	/*
+	 * read no more than will fit in tbuf once filtered; the filter may
+	 * write a held sequence that turns out not to be one of ours ahead
+	 * of what it has read.
+	 */
+	if (RDSZ - (s->toff + s->tlen) > 0) {
+	    s->calls++;
+	    bytes = read(pfds[2].fd, s->rbuf, RDSZ - (s->toff + s->tlen));
+	    if (bytes > 0) {
+		if (s->tlen == 0)
+		    gettimeofday(&s->held, NULL);
+		s->rbytes += bytes;
+		cp = s->tbuf + s->toff + s->tlen;
+		s->tlen += vtstream(&s->vs, s->rbuf, bytes, cp);
+		s->tbuf[s->toff + s->tlen] = '\0';
+		if (s->tlen > 0)
+		    pfds[1].events |= POLLOUT;
+	    } else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+		/* read error */
+		return(1);
 	    }
 	} else {
-	    *(buf + pmatch[0].rm_so++) = '\r';
-	    *(buf + pmatch[0].rm_so++) = '\n';
-	    if (len - pmatch[0].rm_eo == 0) {
-		buf[pmatch[0].rm_so] = '\0';
-	    } else {
-		memmove(buf + pmatch[0].rm_so, buf + pmatch[0].rm_eo,
-		       len - pmatch[0].rm_eo + 1);
-	    }
-	    len -= pmatch[0].rm_eo - pmatch[0].rm_so;
-	    /* start over with the first CR regex */
-	    x = N_REG - 1 - N_CRs;
+	    /* tbuf is full; wait for hlogin to take some before reading */
+	    pfds[2].events &= ~POLLIN;
 	}
     }
+    if (pfds[2].revents & POLLEXP)
+	return(1);
 
-    return(len);
+    return(0);
 }
 
-/* like strcspn(), but works around a bug in a particular O/S */
-size_t
-mystrcspn(const char *s, const char *charset)
+/*
+ * allocate a session relaying hlogin's in and out fds, which may be the
+ * same socket.
+ */
+struct sess *
+sess_new(int in, int out)
 {
-    size_t	len;
-    const char	*csp;
+    struct sess	*s;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+	return(NULL);
+
+    s->pfds[0].fd = in;
+    s->pfds[0].events = POLLIN | POLLEXP;
+    s->pfds[1].fd = out;
+    s->pfds[1].events = POLLEXP;
+    s->pfds[2].fd = -1;
+    s->pfds[2].events = POLLIN | POLLEXP;
+    s->attached = 1;
+    gettimeofday(&s->start, NULL);
+    s->active = s->start.tv_sec;
+    strcpy(s->name, "-");
+
+    s->next = sessions;
+    sessions = s;
+
+    return(s);
+}
 
-    for (len = 0; *s != '\0'; s++) {
-	for (csp = charset; *csp != '\0'; csp++)
-	    if (*s == *csp)
-		return(len);
-	len++;
-    }
+/* reap exited children and mark their sessions */
+void
+sess_reap(void)
+{
+    struct sess	*s;
+    int		status;
+    pid_t	pid;
 
-    return(len);
+    sigchld = 0;
+    while ((pid = wait3(&status, WNOHANG, NULL)) > 0) {
+	if (debug)
+	    fprintf(stderr, "reap child %d\n", (int)pid);
+	for (s = sessions; s != NULL; s = s->next) {
+	    if (s->child == pid) {
+		s->child = 0;
+		break;
+	    }
+	}
+    }
+    return;
 }
 
-RETSIGTYPE
-reapchild(int sig)
+/*
+ * allocate a pty for telnet/ssh, then fork and exec argv on it.  return
+ * EX_OK or the exit value for the error.
+ */
+int
+sess_spawn(struct sess *s, char **argv)
 {
-    int         status;
-    pid_t       pid;
+    char		ptyname[FILENAME_MAX + 1];
+    int			argc,
+			ptym,			/* master pty */
+			ptys;			/* slave pty */
+    struct termios	tios;
 
-    if (debug)
-	fprintf(stderr, "GOT SIGNAL %d\n", sig);
+    /* the device is the last argument, unless that is a telnet port */
+    for (argc = 0; argv[argc] != NULL; argc++)
+	;
+    if (argc > 2 && strspn(argv[argc - 1], "0123456789") ==
+						strlen(argv[argc - 1]))
+	argc--;
+    snprintf(s->name, sizeof(s->name), "%s", argv[argc - 1]);
 
-    while ((pid = wait3(&status, WNOHANG, NULL)) > 0) {
-	if (debug)
-            fprintf(stderr, "reap child %d\n", (int)pid);
-	if (pid == child) {
-	    child = 0;
-	    sigrx = 1;
-	    break;
+    if (openpty(&ptym, &ptys, ptyname, NULL, NULL)) {
+	fprintf(stderr, "%s: could not allocate pty: %s\n", progname,
+		strerror(errno));
+	return(EX_TEMPFAIL);
+    }
+    /* make the pty raw */
+    if (tcgetattr(ptys, &tios)) {
+	fprintf(stderr, "%s: tcgetattr() failed: %s\n", progname,
+		strerror(errno));
+	close(ptym);
+	close(ptys);
+	return(EX_OSERR);
+    }
+    tios.c_lflag &= ~ECHO;
+    tios.c_lflag &= ~ICANON;
+#ifdef VMIN
+    tios.c_cc[VMIN] = 1;
+    tios.c_cc[VTIME] = 0;
+#endif
+    if (tcsetattr(ptys, TCSANOW, &tios)) {
+	fprintf(stderr, "%s: tcsetattr() failed: %s\n", progname,
+		strerror(errno));
+	close(ptym);
+	close(ptys);
+	return(EX_OSERR);
+    }
+
+    if ((s->child = fork()) == -1) {
+	fprintf(stderr, "%s: fork() failed: %s\n", progname, strerror(errno));
+	s->child = 0;
+	close(ptym);
+	close(ptys);
+	return(EX_TEMPFAIL);
+    }
+
+    if (s->child == 0) {
+	struct winsize ws;
+
+	/*
+	 * Make sure our terminal length and width are something greater
+	 * than 1, for pagers on stupid boxes.
+	 */
+	ioctl(ptys, TIOCGWINSZ, &ws);
+	ws.ws_row = 24;
+	ws.ws_col = 132;
+	ioctl(ptys, TIOCSWINSZ, &ws);
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	/* close the master pty & std* inherited from the parent */
+	close(ptym);
+	if (ptys != 0)
+	    close(0);
+	if (ptys != 1)
+	    close(1);
+	if (ptys != 2)
+	    close(2);
+#ifdef TIOCSCTTY
+	setsid();
+	if (ioctl(ptys, TIOCSCTTY, NULL) == -1) {
+	    snprintf(ptyname, FILENAME_MAX, "%s: could not set controlling "
+		     "tty: %s\n", progname, strerror(errno));
+	    write(0, ptyname, strlen(ptyname));
+	    _exit(EX_OSERR);
+	}
+#endif
+
+	/* close stdin/out/err and attach them to the pipes */
+	if (dup2(ptys, 0) == -1 || dup2(ptys, 1) == -1 || dup2(ptys, 2) == -1) {
+	    snprintf(ptyname, FILENAME_MAX, "%s: dup2() failed: %s\n", progname,
+		     strerror(errno));
+	    write(0, ptyname, strlen(ptyname));
+	    _exit(EX_OSERR);
 	}
+	if (ptys > 2)
+	    close(ptys);
+
+	if (replayfile != NULL)
+	    _exit(replay(replayfile));
+
+	/* exec telnet/ssh */
+	execvp(argv[0], argv);
+	snprintf(ptyname, FILENAME_MAX, "%s: execvp() failed: %s\n", progname,
+		 strerror(errno));
+	write(0, ptyname, strlen(ptyname));
+	_exit(EX_TEMPFAIL);
+	/*NOTREACHED*/
+    }
+
+    /* parent */
+    if (debug)
+	fprintf(stderr, "child %d\n", (int)s->child);
+
+    /* close the slave pty */
+    close(ptys);
+
+    /* make FDs non-blocking */
+    if (fcntl(ptym, F_SETFL, O_NONBLOCK) ||
+	fcntl(ptym, F_SETFD, FD_CLOEXEC)) {
+	fprintf(stderr, "%s: fcntl(NONBLOCK) failed: %s\n", progname,
+		strerror(errno));
+	close(ptym);
+	return(EX_OSERR);
     }
+    s->pfds[2].fd = ptym;
+
+    return(EX_OK);
+}
+
+/*
+ * account for bytes of tbuf written to hlogin; the delay is from the arrival
+ * of the oldest of them, s->held.
+ */
+void
+sess_wrote(struct sess *s, ssize_t bytes)
+{
+    struct timeval	now;
+    unsigned long	lat;
+
+    gettimeofday(&now, NULL);
+    lat = (now.tv_sec - s->held.tv_sec) * 1000000 +
+	  (now.tv_usec - s->held.tv_usec);
+    s->lattot += lat;
+    if (lat > s->latmax)
+	s->latmax = lat;
+    s->writes++;
+    s->wbytes += bytes;
+
     return;
 }
 
@@ -707,7 +1302,11 @@ void
 usage(void)
 {
     fprintf(stderr, "usage: %s [-hv] [-t timeout] <telnet|ssh> [<ssh options>]"
-	    " <hostname> [<telnet_port>]\n", progname);
+	    " <hostname> [<telnet_port>]\n"
+	    "       %s [-dhv] [-t timeout] [-k keyfile] -l port\n"
+	    "       %s [-d] -r capture-file\n"
+	    "       %s -b capture-file\n", progname, progname, progname,
+	    progname);
     return;
 }
 
@@ -719,6 +1318,164 @@ vers(void)
 }
 
 
+/*
+ * feed one byte to the filter, writing what it completes to out.  a byte
+ * that might continue a sequence is held in vs until the next determines
+ * whether the sequence is removed or written out.  return the number of
+ * bytes written.
+ */
+size_t
+vtbyte(struct vtstate *vs, char c, char *out)
+{
+    char	retry[VT_MAXLEN];
+    size_t	i,
+		n,
+		w;
+    ssize_t	m;
+    int		part,
+		x;
+
+    if (vs->plen == 0) {
+	if (c == ESC) {
+	    vs->pend[vs->plen++] = c;
+	    return(0);
+	}
+	if (c == '\x07')
+	    return(0);
+	*out = c;
+	return(1);
+    }
+
+    /* bells are removed, even from within another sequence */
+    if (c == '\x07')
+	return(0);
+
+    vs->pend[vs->plen++] = c;
+    for (part = x = 0; x < VT_N; x++) {
+	if ((m = vtcmp(vs->pend, vs->plen, x)) > 0) {
+	    vs->plen = 0;
+	    if (x < VT_CR)
+		return(0);
+	    out[0] = '\r';
+	    out[1] = '\n';
+	    return(2);
+	}
+	if (m < 0)
+	    part = 1;
+    }
+    if (part && vs->plen < VT_MAXLEN)
+	return(0);
+
+    /*
+     * not one of ours; write the ESC and run the rest through again, as it
+     * may hold the start of another sequence.
+     */
+    n = vs->plen - 1;
+    memcpy(retry, vs->pend + 1, n);
+    vs->plen = 0;
+    out[0] = ESC;
+    for (w = 1, i = 0; i < n; i++)
+	w += vtbyte(vs, retry[i], out + w);
+
+    return(w);
+}
+
+/*
+ * compare the n bytes at s with sequence x.  return the length of the
+ * sequence if s begins with it, -1 if s is a proper prefix of it, or 0.
+ */
+ssize_t
+vtcmp(const char *s, size_t n, int x)
+{
+    const char	*seq;
+    size_t	i,
+		j;
+
+    if ((seq = vtseq[x]) != NULL) {
+	for (i = 0; seq[i] != '\0'; i++) {
+	    if (i == n)
+		return(-1);
+	    if (s[i] != seq[i])
+		return(0);
+	}
+	return(i);
+    }
+
+    /* ESC [ [0-9]+ ; [0-9]+ (r|H) */
+    if (s[0] != ESC)
+	return(0);
+    if (n < 2)
+	return(-1);
+    if (s[1] != '[')
+	return(0);
+    for (i = 2; i < n && s[i] >= '0' && s[i] <= '9'; i++)
+	;
+    if (i == n)
+	return(-1);
+    if (i == 2 || s[i] != ';')
+	return(0);
+    for (j = ++i; i < n && s[i] >= '0' && s[i] <= '9'; i++)
+	;
+    if (i == n)
+	return(-1);
+    if (i == j || s[i] != (x == VT_CS ? 'r' : 'H'))
+	return(0);
+    return(i + 1);
+}
+
+/*
+ * Remove/replace vt100/220 screen manipulation escape sequences so they do
+ * not litter the output.  The len bytes of in are filtered to out, which must
+ * not overlap in, and the number of bytes written is returned; as a held
+ * sequence that turns out not to be one of ours is written when refuted, that
+ * may be up to VT_MAXLEN - 1 more than len.  The filter is resumable; an
+ * incomplete sequence at the end of in is held in vs until the next call
+ * completes or refutes it, so data read from the pty can be passed through as
+ * it arrives, whatever the read boundaries.
+ */
+size_t
+vtstream(struct vtstate *vs, const char *in, size_t len, char *out)
+{
+    size_t	r,
+		w;
+
+    for (r = w = 0; r < len; r++) {
+	if (vs->plen == 0 && in[r] != ESC && in[r] != '\x07')
+	    out[w++] = in[r];
+	else
+	    w += vtbyte(vs, in[r], out + w);
+    }
+
+    return(w);
+}
+
+/*
+ * write all of buf to the non-blocking fd, waiting up to timeo seconds at a
+ * time for it to drain.
+ */
+ssize_t
+xwrite(int fd, const char *buf, size_t len)
+{
+    struct pollfd	pfd;
+    ssize_t		n;
+    size_t		off = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while (off < len) {
+	if ((n = write(fd, buf + off, len - off)) > 0) {
+	    off += n;
+	    continue;
+	}
+	if (n < 0 && errno != EAGAIN && errno != EINTR)
+	    return(-1);
+	if (poll(&pfd, 1, (timeo * 1000)) == 0)
+	    return(-1);
+    }
+
+    return(off);
+}
+
 #if !HAVE_OPENPTY
 #include <grp.h>
 #define TTY_LETTERS	"pqrstuvwxyzPQRST"